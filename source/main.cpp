@@ -38,17 +38,70 @@ const static char PEER2_NAME[] = "RGBSensor";
 #define UUID_GREEN_CHARACTERISTIC "12345678-1234-5678-1234-56789abcdef2"
 #define UUID_BLUE_CHARACTERISTIC "12345678-1234-5678-1234-56789abcdef3"
 
-Serial pc(USBTX, USBRX, 14400);
-
-static EventQueue event_queue(/* event count */ 10 * EVENTS_EVENT_SIZE);
+// UUID storico dei campioni bufferizzati dal sensore ambientale
+#define UUID_HISTORY_CHARACTERISTIC "12345678-1234-5678-1234-56789abcdf01"
+
+/* Ogni notifica dello storico contiene un numero di sequenza a 16 bit, che
+ * riparte da 0 a ogni nuova sottoscrizione, seguito da record interi: istante
+ * Unix in secondi uint32, temperatura int16, umidita' uint16, pressione uint32.
+ * Una notifica senza record segnala la fine dello storico.
+ * Il sensore trasmette senza attendere, ma al massimo HISTORY_WINDOW_BLOCKS
+ * blocchi oltre l'ultimo confermato. Il client scrive senza risposta sulla
+ * caratteristica un opcode seguito da un numero di sequenza a 16 bit:
+ *  - HISTORY_OP_ACK: i blocchi fino a quello indicato sono stati ricevuti, il
+ *    sensore li cancella e sposta avanti la finestra;
+ *  - HISTORY_OP_RESEND: il sensore riprende a trasmettere da quel blocco. */
+#define HISTORY_HEADER_SIZE 2
+#define HISTORY_RECORD_SIZE 12
+#define HISTORY_OP_ACK 0x01
+#define HISTORY_OP_RESEND 0x02
+#define HISTORY_WINDOW_BLOCKS 8
+#define HISTORY_ACK_INTERVAL 4
+
+/* Record dello storico in attesa di essere stampati */
+#define HISTORY_BUFFER_RECORDS 512
+
+/* Chiude lo streaming se il sensore non invia blocchi per questo intervallo */
+#define HISTORY_TIMEOUT_MS 3000
+
+/* Intervallo di connessione in unita' da 1.25 ms e supervision timeout in unita' da 10 ms:
+ * breve durante lo storico, piu' lungo per le sole letture periodiche */
+#define HISTORY_FAST_INTERVAL_MIN 6
+#define HISTORY_FAST_INTERVAL_MAX 12
+#define HISTORY_IDLE_INTERVAL_MIN 40
+#define HISTORY_IDLE_INTERVAL_MAX 80
+#define HISTORY_SUPERVISION_TIMEOUT 400
+
+Serial pc(USBTX, USBRX, MBED_CONF_PLATFORM_STDIO_BAUD_RATE);
+
+static EventQueue event_queue(/* event count */ 16 * EVENTS_EVENT_SIZE);
 
 static DiscoveredCharacteristic temp_characteristic;
 static DiscoveredCharacteristic humidity_characteristic;
 static DiscoveredCharacteristic pressure_characteristic;
+static DiscoveredCharacteristic history_characteristic;
 
 static bool trigger_temp_characteristic = false;
 static bool trigger_humidity_characteristic = false;
 static bool trigger_pressure_characteristic = false;
+static bool trigger_history_characteristic = false;
+
+static bool history_transfer_active = false;
+static bool history_transfer_closing = false;
+static bool history_retransmit_pending = false;
+static bool history_gap_reported = false;
+static bool history_drain_scheduled = false;
+static Gap::Handle_t history_connection_handle;
+static GattAttribute::Handle_t history_cccd_handle = 0;
+static uint16_t history_unacked_blocks = 0;
+static uint16_t history_next_sequence = 0;
+static int history_timeout_event = 0;
+
+static uint8_t history_buffer[HISTORY_BUFFER_RECORDS][HISTORY_RECORD_SIZE];
+static uint16_t history_buffer_head = 0;
+static uint16_t history_buffer_count = 0;
+
+static uint16_t att_mtu = 23;
 
 bool flag_temp = true;
 bool flag_hum = true;
@@ -90,10 +143,286 @@ void on_characteristic_read(const GattReadCallbackParams *response) {
     }
 }
 
+/* Numero massimo di record in una notifica con l'MTU negoziato */
+uint16_t history_records_per_block() {
+    return (att_mtu - 3 - HISTORY_HEADER_SIZE) / HISTORY_RECORD_SIZE;
+}
+
+/* Scrive senza risposta un comando per il sensore: conferma o richiesta di ritrasmissione */
+ble_error_t write_history_command(uint8_t opcode, uint16_t sequence) {
+    uint8_t command[3] = { opcode };
+    memcpy(command + 1, &sequence, sizeof(sequence));
+    ble_error_t error = BLE::Instance().gattClient().write(
+        GattClient::GATT_OP_WRITE_CMD,
+        history_connection_handle,
+        history_characteristic.getValueHandle(),
+        sizeof(command),
+        command
+    );
+    if (error) {
+        print_error(error, "Error caused by history command write");
+    }
+    return error;
+}
+
+/* Conferma ogni HISTORY_ACK_INTERVAL blocchi, solo se il buffer ha posto per
+ * un'intera finestra: altrimenti la conferma e' rimandata al drain */
+void send_history_ack() {
+    if (history_unacked_blocks < HISTORY_ACK_INTERVAL ||
+        HISTORY_BUFFER_RECORDS - history_buffer_count < HISTORY_WINDOW_BLOCKS * history_records_per_block()) {
+        return;
+    }
+
+    if (write_history_command(HISTORY_OP_ACK, history_next_sequence - 1) == BLE_ERROR_NONE) {
+        history_unacked_blocks = 0;
+    }
+}
+
+/* Scrive il CCCD dello storico: 0x0001 avvia lo streaming, 0x0000 lo chiude */
+ble_error_t write_history_cccd(uint16_t value) {
+    return BLE::Instance().gattClient().write(
+        GattClient::GATT_OP_WRITE_REQ,
+        history_connection_handle,
+        history_cccd_handle,
+        sizeof(value),
+        reinterpret_cast<const uint8_t *>(&value)
+    );
+}
+
+void set_history_connection_interval(bool fast) {
+    ble_error_t error = BLE::Instance().gap().updateConnectionParameters(
+        history_connection_handle,
+        ble::conn_interval_t(fast ? HISTORY_FAST_INTERVAL_MIN : HISTORY_IDLE_INTERVAL_MIN),
+        ble::conn_interval_t(fast ? HISTORY_FAST_INTERVAL_MAX : HISTORY_IDLE_INTERVAL_MAX),
+        ble::slave_latency_t(0),
+        ble::supervision_timeout_t(HISTORY_SUPERVISION_TIMEOUT)
+    );
+    if (error) {
+        print_error(error, "Error caused by Gap::updateConnectionParameters");
+    }
+}
+
+void cancel_history_timeout() {
+    if (history_timeout_event) {
+        event_queue.cancel(history_timeout_event);
+        history_timeout_event = 0;
+    }
+}
+
+/* Fine dello storico: riattiva le letture periodiche */
+void finish_history_transfer() {
+    cancel_history_timeout();
+    history_transfer_active = false;
+    history_transfer_closing = false;
+    set_history_connection_interval(false);
+}
+
+/* Chiude lo streaming; le letture ripartono quando il CCCD e' scritto */
+void stop_history_transfer() {
+    cancel_history_timeout();
+    history_transfer_closing = true;
+
+    ble_error_t error = write_history_cccd(0x0000);
+    if (error) {
+        print_error(error, "Error caused by history CCCD write");
+        finish_history_transfer();
+    }
+}
+
+/* Il sensore non ha piu' inviato blocchi: i blocchi non confermati restano sul sensore */
+void on_history_timeout() {
+    history_timeout_event = 0;
+    printf("History timeout, last block: %u\r\n", (uint16_t)(history_next_sequence - 1));
+    stop_history_transfer();
+}
+
+/* Senza watchdog uno streaming interrotto bloccherebbe le letture: in quel caso si chiude */
+void restart_history_timeout() {
+    cancel_history_timeout();
+    history_timeout_event = event_queue.call_in(HISTORY_TIMEOUT_MS, on_history_timeout);
+    if (!history_timeout_event) {
+        printf("History watchdog not scheduled\r\n");
+        stop_history_transfer();
+    }
+}
+
+void drain_history_buffer();
+
+/* Se la coda e' piena il drain viene ritentato da update_sensor_values */
+void schedule_history_drain() {
+    if (history_drain_scheduled || !history_buffer_count) {
+        return;
+    }
+    history_drain_scheduled = event_queue.call(drain_history_buffer) != 0;
+}
+
+/* Stampa un record per evento, cosi' la coda BLE non resta bloccata sulla seriale */
+void drain_history_buffer() {
+    history_drain_scheduled = false;
+
+    const uint8_t *record = history_buffer[history_buffer_head];
+    uint32_t timestamp;
+    int16_t temperature;
+    uint16_t humidity;
+    uint32_t pressure;
+    memcpy(&timestamp, record, sizeof(timestamp));
+    memcpy(&temperature, record + 4, sizeof(temperature));
+    memcpy(&humidity, record + 6, sizeof(humidity));
+    memcpy(&pressure, record + 8, sizeof(pressure));
+
+    history_buffer_head = (history_buffer_head + 1) % HISTORY_BUFFER_RECORDS;
+    history_buffer_count--;
+    printf("History %lu s - Temperature: %.2f Humidity: %.2f Pressure: %.2f\n",
+           (unsigned long) timestamp, temperature / 100.0, humidity / 100.0, pressure / 10.0);
+
+    if (history_transfer_active && !history_transfer_closing) {
+        /* c'e' di nuovo spazio: chiede al sensore di ritrasmettere il blocco scartato */
+        if (history_retransmit_pending &&
+            HISTORY_BUFFER_RECORDS - history_buffer_count >= history_records_per_block() &&
+            write_history_command(HISTORY_OP_RESEND, history_next_sequence) == BLE_ERROR_NONE) {
+            history_retransmit_pending = false;
+            restart_history_timeout();
+        }
+        send_history_ack();
+    }
+
+    schedule_history_drain();
+}
+
+/* Avvia lo scaricamento dello storico; le letture periodiche restano sospese fino alla fine */
+void start_history_transfer() {
+    history_next_sequence = 0;
+    history_unacked_blocks = 0;
+    history_transfer_closing = false;
+    history_retransmit_pending = false;
+    history_gap_reported = false;
+
+    ble_error_t error = write_history_cccd(0x0001);
+    if (error) {
+        print_error(error, "Error caused by history CCCD write");
+        history_transfer_active = false;
+        return;
+    }
+
+    set_history_connection_interval(true);
+
+    /* un sensore senza storico o con firmware vecchio potrebbe non rispondere mai */
+    restart_history_timeout();
+}
+
+/* Callback per i descrittori della caratteristica storico */
+void on_history_descriptor(const CharacteristicDescriptorDiscovery::DiscoveryCallbackParams_t *params) {
+    if (params->descriptor.getUUID() == UUID(GattCharacteristic::BLE_UUID_DESCRIPTOR_CLIENT_CHAR_CONFIG) &&
+        params->descriptor.getAttributeHandle() <= history_characteristic.getLastHandle()) {
+        history_cccd_handle = params->descriptor.getAttributeHandle();
+    }
+}
+
+void on_history_descriptor_termination(const CharacteristicDescriptorDiscovery::TerminationCallbackParams_t *params) {
+    if (params->status != BLE_ERROR_NONE || !history_cccd_handle) {
+        printf("History CCCD not found\r\n");
+        history_transfer_active = false;
+        return;
+    }
+
+    start_history_transfer();
+}
+
+/* Cerca il CCCD dello storico: le letture periodiche restano sospese fino alla fine */
+void discover_history_cccd() {
+    history_cccd_handle = 0;
+    history_transfer_active = true;
+
+    ble_error_t error = history_characteristic.discoverDescriptors(
+        on_history_descriptor,
+        on_history_descriptor_termination
+    );
+    if (error) {
+        print_error(error, "Error caused by history descriptor discovery");
+        history_transfer_active = false;
+    }
+}
+
+/* Callback per le notifiche: copia i blocchi in ordine nel buffer dello storico */
+void on_history_notification(const GattHVXCallbackParams *params) {
+    if (!history_transfer_active || history_transfer_closing ||
+        params->handle != history_characteristic.getValueHandle() ||
+        params->len < HISTORY_HEADER_SIZE) {
+        return;
+    }
+
+    restart_history_timeout();
+    if (history_transfer_closing) {
+        return;
+    }
+
+    uint16_t sequence;
+    memcpy(&sequence, params->data, sizeof(sequence));
+
+    /* blocco gia' ricevuto: il sensore lo ha ritrasmesso */
+    if ((int16_t)(sequence - history_next_sequence) < 0) {
+        return;
+    }
+
+    /* buco nella sequenza: una sola richiesta di ritrasmissione per buco */
+    if (sequence != history_next_sequence) {
+        if (!history_gap_reported && !history_retransmit_pending &&
+            write_history_command(HISTORY_OP_RESEND, history_next_sequence) == BLE_ERROR_NONE) {
+            history_gap_reported = true;
+        }
+        return;
+    }
+
+    uint16_t records = (params->len - HISTORY_HEADER_SIZE) / HISTORY_RECORD_SIZE;
+
+    /* la finestra dovrebbe evitarlo: il blocco viene richiesto quando il drain libera spazio */
+    if (HISTORY_BUFFER_RECORDS - history_buffer_count < records) {
+        history_retransmit_pending = true;
+        return;
+    }
+
+    history_gap_reported = false;
+    history_next_sequence = sequence + 1;
+    history_unacked_blocks++;
+
+    if (records == 0) {
+        /* conferma finale: il sensore puo' cancellare tutto lo storico */
+        if (write_history_command(HISTORY_OP_ACK, sequence) == BLE_ERROR_NONE) {
+            history_unacked_blocks = 0;
+        }
+        printf("History complete\r\n");
+        stop_history_transfer();
+        return;
+    }
+
+    const uint8_t *payload = params->data + HISTORY_HEADER_SIZE;
+    for (uint16_t i = 0; i < records; i++) {
+        uint16_t tail = (history_buffer_head + history_buffer_count) % HISTORY_BUFFER_RECORDS;
+        memcpy(history_buffer[tail], payload, HISTORY_RECORD_SIZE);
+        payload += HISTORY_RECORD_SIZE;
+        history_buffer_count++;
+    }
+
+    send_history_ack();
+    schedule_history_drain();
+}
+
+/* Callback quando la scrittura del CCCD viene confermata */
+void on_history_written(const GattWriteCallbackParams *params) {
+    if (!history_cccd_handle || params->handle != history_cccd_handle) {
+        return;
+    }
+
+    /* errore in apertura o chiusura completata: riattiva le letture periodiche */
+    if (params->status != BLE_ERROR_NONE || history_transfer_closing) {
+        finish_history_transfer();
+    }
+}
+
 /* funzione che legge tutte le caratteristiche */
 void read_all_characteristics() {
 
-    if (!BLE::Instance().gattClient().isServiceDiscoveryActive()) {
+    if (!BLE::Instance().gattClient().isServiceDiscoveryActive() && !history_transfer_active) {
         if (trigger_temp_characteristic && (flag_temp == true)) {
             flag_hum = false;
             flag_press = false;
@@ -113,6 +442,16 @@ void read_all_characteristics() {
 
 /* Callback per discovered characteristics */
 void characteristic_discovery(const DiscoveredCharacteristic *characteristicP) {
+    if (characteristicP->getUUID().shortOrLong() == UUID::UUID_TYPE_LONG) {
+        if (characteristicP->getUUID() == UUID(UUID_HISTORY_CHARACTERISTIC) &&
+            characteristicP->getProperties().notify() &&
+            characteristicP->getProperties().writeWoResp()) {
+            history_characteristic = *characteristicP;
+            trigger_history_characteristic = true;
+        }
+        return;
+    }
+
     if (characteristicP->getUUID().getShortUUID() == UUID_TEMPERATURE_CHAR) {
         temp_characteristic = *characteristicP;
         trigger_temp_characteristic = true;
@@ -131,12 +470,19 @@ void characteristic_discovery(const DiscoveredCharacteristic *characteristicP) {
 
 /* Callback per service discovery termination */
 void discovery_termination(Gap::Handle_t connectionHandle) {
+    /* prima recupera i campioni accumulati durante la disconnessione */
+    if (trigger_history_characteristic) {
+        history_connection_handle = connectionHandle;
+        history_transfer_active = true;
+        event_queue.call(discover_history_cccd);
+    }
+
     if (trigger_temp_characteristic || trigger_humidity_characteristic || trigger_pressure_characteristic) {
         event_queue.call(read_all_characteristics);
     }
 }
 
-class Client : ble::Gap::EventHandler {
+class Client : ble::Gap::EventHandler, GattClient::EventHandler {
 public:
     Client(BLE &ble, events::EventQueue &event_queue) :
         _ble(ble),
@@ -147,6 +493,7 @@ public:
 
     void start() {
         _ble.gap().setEventHandler(this);
+        _ble.gattClient().setEventHandler(this);
 
         _ble.init(this, &Client::on_init_complete);
 
@@ -168,6 +515,10 @@ private:
         /* Registra la funzione on_characteristic_read come callback per gli eventi di lettura dei dati GATT */
         _ble.gattClient().onDataRead(on_characteristic_read);
 
+        /* Callback per lo streaming dello storico tramite notifiche */
+        _ble.gattClient().onHVX(on_history_notification);
+        _ble.gattClient().onDataWritten(on_history_written);
+
         /* Definisce e imposta i parametri di scansione BLE. In questo caso, vengono utilizzati i parametri di default. */ 
         ble::ScanParameters scan_params;
         _ble.gap().setScanParameters(scan_params);
@@ -175,18 +526,41 @@ private:
     }
 
     void update_sensor_values() {
+        schedule_history_drain();
+
         if (trigger_temp_characteristic || trigger_humidity_characteristic || trigger_pressure_characteristic) {
             read_all_characteristics();
         }
     }
 
-    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent&) {
+    /** Salva l'MTU negoziato: determina quanti record stanno in un blocco dello storico */
+    void onAttMtuChange(ble::connection_handle_t connectionHandle, uint16_t attMtuSize) override {
+        att_mtu = attMtuSize;
+        printf("ATT MTU: %u\r\n", attMtuSize);
+    }
+
+    /** Non viene mai chiamata con lo shield BlueNRG, che non supporta la data length extension */
+    void onDataLengthChange(ble::connection_handle_t connectionHandle, uint16_t txSize, uint16_t rxSize) override {
+        printf("Data length tx: %u rx: %u\r\n", txSize, rxSize);
+    }
+
+    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent&) override {
+        /* i blocchi non confermati restano sul sensore e verranno ritrasmessi */
+        cancel_history_timeout();
+        history_transfer_active = false;
+        history_transfer_closing = false;
+        trigger_history_characteristic = false;
+        att_mtu = 23;
+
         _ble.gap().startScan();
         _is_connecting = false;
     }
 
-    void onConnectionComplete(const ble::ConnectionCompleteEvent& event) {
+    void onConnectionComplete(const ble::ConnectionCompleteEvent& event) override {
         if (event.getOwnRole() == ble::connection_role_t::CENTRAL) {
+            /* MTU ampio per trasferire piu' record per notifica */
+            _ble.gattClient().negotiateAttMtu(event.getConnectionHandle());
+
             _ble.gattClient().onServiceDiscoveryTermination(discovery_termination);
             _ble.gattClient().launchServiceDiscovery(
                 event.getConnectionHandle(),
@@ -201,7 +575,7 @@ private:
         _is_connecting = false;
     }
 
-    void onAdvertisingReport(const ble::AdvertisingReportEvent &event) {
+    void onAdvertisingReport(const ble::AdvertisingReportEvent &event) override {
         /* don't bother with analysing scan result if we're already connecting */
         if (_is_connecting) {
             return;